@@ -0,0 +1,197 @@
+// Author: Can Yang
+// Email : cyang@kth.se
+//
+// Double-buffered file streams. While the parser consumes one block of
+// the input, the next block is read with pread in a background thread;
+// while the formatter fills one block of the output, the previous block
+// is written with pwrite in a background thread. Pipes and FIFOs, which
+// cannot seek, are read and written sequentially with read and write.
+
+#ifndef GPS2TRAJ_ASYNC_IO_HPP
+#define GPS2TRAJ_ASYNC_IO_HPP
+
+#include <vector>
+#include <string>
+#include <streambuf>
+#include <future>
+#include <utility>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+const size_t ASYNC_IO_BLOCK_SIZE = 1 << 22;
+
+inline bool is_seekable(int fd){
+  return lseek(fd, 0, SEEK_CUR) >= 0;
+};
+
+// Read until size bytes are read or the end of file is reached,
+// return -1 on error.
+inline ssize_t read_block(int fd, bool seekable, char *buf, size_t size,
+                          off_t offset){
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = seekable ? pread(fd, buf + done, size - done, offset + done)
+                         : read(fd, buf + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+};
+
+// Write the whole block, continuing after partial writes.
+inline ssize_t write_block(int fd, bool seekable, const char *buf,
+                           size_t size, off_t offset){
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = seekable ? pwrite(fd, buf + done, size - done, offset + done)
+                         : write(fd, buf + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return done;
+};
+
+class AsyncReadBuf : public std::streambuf {
+public:
+  explicit AsyncReadBuf(const std::string &filename,
+                        size_t block_size = ASYNC_IO_BLOCK_SIZE) :
+    front_(block_size), back_(block_size), offset_(0), failed_(false) {
+    fd_ = open(filename.c_str(), O_RDONLY);
+    setg(front_.data(), front_.data(), front_.data());
+    if (fd_ >= 0) {
+      seekable_ = is_seekable(fd_);
+      prefetch();
+    }
+  };
+  ~AsyncReadBuf(){
+    if (pending_.valid()) pending_.wait();
+    if (fd_ >= 0) close(fd_);
+  };
+  bool is_open() const {
+    return fd_ >= 0;
+  };
+  // True if reading stopped because of an I/O error rather than EOF
+  bool failed() const {
+    return failed_;
+  };
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+    if (!pending_.valid()) {
+      return traits_type::eof();
+    }
+    ssize_t n = pending_.get();
+    if (n < 0) {
+      failed_ = true;
+    }
+    if (n <= 0) {
+      return traits_type::eof();
+    }
+    std::swap(front_, back_);
+    setg(front_.data(), front_.data(), front_.data() + n);
+    offset_ += n;
+    if (n == (ssize_t) back_.size()) {
+      prefetch();
+    }
+    return traits_type::to_int_type(*gptr());
+  };
+private:
+  void prefetch(){
+    pending_ = std::async(std::launch::async, read_block, fd_, seekable_,
+                          back_.data(), back_.size(), offset_);
+  };
+  int fd_;
+  bool seekable_;
+  std::vector<char> front_;
+  std::vector<char> back_;
+  off_t offset_;
+  bool failed_;
+  std::future<ssize_t> pending_;
+};
+
+class AsyncWriteBuf : public std::streambuf {
+public:
+  // A positive start_offset keeps the first start_offset bytes of an
+  // existing file and continues writing after them.
+  explicit AsyncWriteBuf(const std::string &filename, off_t start_offset = 0,
+                         size_t block_size = ASYNC_IO_BLOCK_SIZE) :
+    front_(block_size), back_(block_size), offset_(start_offset),
+    failed_(false) {
+    if (start_offset > 0) {
+      fd_ = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+      if (fd_ >= 0 && ftruncate(fd_, start_offset) != 0) {
+        close(fd_);
+        fd_ = -1;
+      }
+    } else {
+      fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    seekable_ = fd_ >= 0 && is_seekable(fd_);
+    // Keep one char free for the char passed to overflow
+    setp(front_.data(), front_.data() + front_.size() - 1);
+  };
+  ~AsyncWriteBuf(){
+    if (fd_ >= 0) {
+      sync();
+      close(fd_);
+    }
+  };
+  bool is_open() const {
+    return fd_ >= 0;
+  };
+  // Number of bytes of the file, including the ones still buffered
+  off_t tell() const {
+    return offset_ + (pptr() - pbase());
+  };
+  // Write all buffered bytes and make them durable on disk
+  bool commit(){
+    return sync() == 0 && (!seekable_ || fsync(fd_) == 0);
+  };
+protected:
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    flush_block();
+    return failed_ ? traits_type::eof() : traits_type::not_eof(ch);
+  };
+  int sync() override {
+    flush_block();
+    wait();
+    return failed_ ? -1 : 0;
+  };
+private:
+  void wait(){
+    if (pending_.valid() && pending_.get() < 0) {
+      failed_ = true;
+    }
+  };
+  // Hand the filled block to a background write and continue
+  // in the other buffer.
+  void flush_block(){
+    size_t n = pptr() - pbase();
+    if (n == 0 || fd_ < 0) return;
+    wait();
+    std::swap(front_, back_);
+    pending_ = std::async(std::launch::async, write_block, fd_, seekable_,
+                          back_.data(), n, offset_);
+    offset_ += n;
+    setp(front_.data(), front_.data() + front_.size() - 1);
+  };
+  int fd_;
+  bool seekable_;
+  std::vector<char> front_;
+  std::vector<char> back_;
+  off_t offset_;
+  bool failed_;
+  std::future<ssize_t> pending_;
+};
+
+#endif // GPS2TRAJ_ASYNC_IO_HPP
@@ -15,6 +15,12 @@
 #include <sys/stat.h>
 #include <getopt.h>
 #include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include "async_io.hpp"
+#include "row_error.hpp"
+#include "projection.hpp"
 
 // Data types
 
@@ -39,28 +45,32 @@ double string2timestamp(const std::string &intermediate,
   return 0;
 };
 
-double string2timestamp(const std::string &intermediate,
-  const std::string &format){
+bool string2timestamp(const std::string &intermediate,
+  const std::string &format, double &timestamp){
   if (format.empty()){
     // double value as timestamp
-    return std::stod(intermediate);
+    return parse_double(intermediate, timestamp);
   } else {
     // 2020-01-01T00:00:27
     std::tm tm = {};
-    strptime(intermediate.c_str(),format.c_str(), &tm);
-    // std::cout<<"Debug "<< intermediate << "" << std::mktime(&tm) <<"\n";
-    return std::mktime(&tm);
+    if (strptime(intermediate.c_str(),format.c_str(), &tm) == NULL) {
+      return false;
+    }
+    timestamp = std::mktime(&tm);
+    return true;
   }
-  return 0;
 };
 
-bool point_comp(Point &p1,Point &p2) {
+bool point_comp(const Point &p1,const Point &p2) {
   return (p1.timestamp<p2.timestamp);
 };
 
 struct Trajectory {
   std::string id;
   std::vector<Point> geom;
+  // Number of points appended with a timestamp smaller than its predecessor,
+  // used to pick the sort strategy (0 means already sorted).
+  long long num_descents = 0;
 };
 
 typedef std::unordered_map<std::string,int> TrajIDMap;
@@ -72,6 +82,13 @@ typedef std::vector<Trajectory> DataStore;
 //   bool write_index=true;
 // };
 
+// Parser used for the timestamp column
+enum class TimeLayout {
+  NUMERIC,  // Unix timestamp (in seconds or milliseconds)
+  ISO8601,  // detected 2020-01-01T00:00:27 or 2020-01-01 00:00:27
+  STRPTIME  // any other strftime template, parsed with strptime
+};
+
 struct InputConfig {
   std::string id_name;
   std::string x_name;
@@ -84,12 +101,55 @@ struct InputConfig {
   char delim;
   bool header;
   std::string time_format;
+  // Set by infer_input_format from the first rows of the file
+  TimeLayout time_layout;
+  bool decimal_comma;
 };
 
 struct OutputConfig {
   bool write_ts=false;
   bool write_tend=false;
   bool write_timestamp=false;
+  bool write_npoints=false;
+  bool write_length=false;
+  bool write_duration=false;
+  bool write_mean_speed=false;
+  bool write_max_speed=false;
+  bool write_min_interval=false;
+  bool write_mean_interval=false;
+  bool write_max_interval=false;
+};
+
+// Statistics of a trip, accumulated over its consecutive point pairs
+struct TripStats {
+  double length = 0;
+  double max_speed = 0;
+  double min_interval = INFINITY;
+  double max_interval = 0;
+};
+
+// A stop is a run of points staying within radius of its first point
+// for at least duration seconds. It ends a trip at the arrival point and
+// the next trip starts at the departure point.
+struct StopConfig {
+  double radius = 0; // stop detection is disabled if not positive
+  double duration = 300;
+  bool enabled() const {
+    return radius > 0;
+  };
+};
+
+void reset_trip_stats(TripStats &stats){
+  stats = TripStats();
+};
+
+void update_trip_stats(TripStats &stats, double time_diff, double distance){
+  stats.length += distance;
+  if (time_diff > 0 && distance / time_diff > stats.max_speed) {
+    stats.max_speed = distance / time_diff;
+  }
+  stats.min_interval = std::min(stats.min_interval, time_diff);
+  stats.max_interval = std::max(stats.max_interval, time_diff);
 };
 
 
@@ -111,6 +171,30 @@ void parse_ofields(OutputConfig &config, const std::string &str){
   if (fields.find("timestamp") != fields.end()) {
     config.write_timestamp = true;
   }
+  if (fields.find("npoints") != fields.end()) {
+    config.write_npoints = true;
+  }
+  if (fields.find("length") != fields.end()) {
+    config.write_length = true;
+  }
+  if (fields.find("duration") != fields.end()) {
+    config.write_duration = true;
+  }
+  if (fields.find("mean_speed") != fields.end()) {
+    config.write_mean_speed = true;
+  }
+  if (fields.find("max_speed") != fields.end()) {
+    config.write_max_speed = true;
+  }
+  if (fields.find("min_interval") != fields.end()) {
+    config.write_min_interval = true;
+  }
+  if (fields.find("mean_interval") != fields.end()) {
+    config.write_mean_interval = true;
+  }
+  if (fields.find("max_interval") != fields.end()) {
+    config.write_max_interval = true;
+  }
 };
 
 // Functions to manipulate trajectories
@@ -127,8 +211,10 @@ void append_point(DataStore &ds, TrajIDMap &id_map, std::string &traj_id,
   if (search != id_map.end()) {
     // A trajectory exists already
     int idx =  search->second;
+    if (p.timestamp < ds[idx].geom.back().timestamp) {
+      ++ds[idx].num_descents;
+    }
     ds[idx].geom.push_back(p);
-    // ds[idx].geom.push_back(p);
   } else {
     // A new node is found, how to ensure that the ds is sorted
     int idx = id_map.size();
@@ -199,8 +285,268 @@ void read_header_config(const std::string &row, InputConfig &config){
   std::cout<<"    Timestamp index "<< timestamp_idx<<"\n";
 };
 
-void read_row_to_point(long long row_index, std::string &row,
-                       InputConfig &config, std::string &traj_id, Point &p){
+// Parse YYYY-MM-DD[T ]HH:MM:SS[.fff][Z]. Without Z the time is local,
+// with the same result as strptime and mktime; mktime is only called
+// once per hour and the minutes and seconds are added to the cached
+// value. With Z the time is UTC and converted with timegm.
+bool iso86012timestamp(const char *str, double &timestamp){
+  static long long cached_hour = -1;
+  static double cached_value = 0;
+  const char *c = str;
+  while (*c == ' ') ++c;
+  int fields[6];
+  const int widths[6] = {4, 2, 2, 2, 2, 2};
+  const char seps[6] = {'-', '-', 'T', ':', ':', 0};
+  for (int f = 0; f < 6; ++f) {
+    int value = 0;
+    for (int k = 0; k < widths[f]; ++k, ++c) {
+      if (*c < '0' || *c > '9') return false;
+      value = value * 10 + (*c - '0');
+    }
+    fields[f] = value;
+    if (f < 5) {
+      if (*c != seps[f] && !(f == 2 && *c == ' ')) return false;
+      ++c;
+    }
+  }
+  if (fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31 ||
+      fields[3] > 23 || fields[4] > 59 || fields[5] > 60) {
+    return false;
+  }
+  double fraction = 0;
+  if (*c == '.') {
+    double scale = 0.1;
+    for (++c; *c >= '0' && *c <= '9'; ++c, scale *= 0.1) {
+      fraction += (*c - '0') * scale;
+    }
+  }
+  bool utc = false;
+  if (*c == 'Z') {
+    utc = true;
+    ++c;
+  }
+  while (std::isspace(static_cast<unsigned char>(*c))) ++c;
+  if (*c != '\0') return false;
+  if (utc) {
+    std::tm tm = {};
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_hour = fields[3];
+    tm.tm_min = fields[4];
+    tm.tm_sec = fields[5];
+    timestamp = timegm(&tm) + fraction;
+    return true;
+  }
+  long long hour = ((fields[0] * 12LL + fields[1]) * 31 + fields[2]) * 24
+                   + fields[3];
+  if (hour != cached_hour) {
+    std::tm tm = {};
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_hour = fields[3];
+    cached_value = std::mktime(&tm);
+    cached_hour = hour;
+  }
+  timestamp = cached_value + fields[4] * 60 + fields[5];
+  if (fraction > 0) timestamp += fraction;
+  return true;
+};
+
+// Parse a coordinate written with a decimal comma, e.g., 116,318417
+bool parse_decimal_comma(const std::string &str, double &value){
+  char buf[64];
+  if (str.size() >= sizeof(buf)) return false;
+  for (size_t i = 0; i <= str.size(); ++i) {
+    buf[i] = (str[i] == ',') ? '.' : str[i];
+  }
+  return parse_double(buf, value);
+};
+
+bool parse_coordinate(const std::string &str, const InputConfig &config,
+                      double &value){
+  if (config.decimal_comma) {
+    return parse_decimal_comma(str, value);
+  }
+  return parse_double(str, value);
+};
+
+bool parse_timestamp(const std::string &str, const InputConfig &config,
+                     double &timestamp){
+  switch (config.time_layout) {
+  case TimeLayout::NUMERIC:
+    return parse_double(str, timestamp);
+  case TimeLayout::ISO8601:
+    return iso86012timestamp(str.c_str(), timestamp);
+  default:
+    return string2timestamp(str, config.time_format, timestamp);
+  }
+};
+
+// Check that the whole string matches a strftime template
+bool match_time_format(const std::string &str, const char *format){
+  std::tm tm = {};
+  const char *end = strptime(str.c_str(), format, &tm);
+  if (end == NULL) return false;
+  while (std::isspace(static_cast<unsigned char>(*end))) ++end;
+  return *end == '\0';
+};
+
+// Templates tried in order when the time format is not specified
+const char *TIME_FORMAT_CANDIDATES[] = {
+  "%Y-%m-%dT%H:%M:%S",
+  "%Y-%m-%d %H:%M:%S",
+  "%Y/%m/%d %H:%M:%S",
+  "%Y/%m/%dT%H:%M:%S",
+  "%d/%m/%Y %H:%M:%S",
+  "%m/%d/%Y %H:%M:%S",
+  "%d.%m.%Y %H:%M:%S",
+  "%Y-%m-%d %H:%M",
+  "%d/%m/%Y %H:%M",
+  "%m/%d/%Y %H:%M"
+};
+
+const int INPUT_FORMAT_SAMPLE_SIZE = 100;
+
+// Return the template with %d and %m swapped if it is also a candidate,
+// otherwise an empty string. Both parse the same samples when every day
+// is at most 12.
+std::string day_month_swapped(const std::string &format){
+  size_t d = format.find("%d");
+  size_t m = format.find("%m");
+  if (d == std::string::npos || m == std::string::npos) return "";
+  std::string swapped = format;
+  swapped[d + 1] = 'm';
+  swapped[m + 1] = 'd';
+  for (const char *candidate : TIME_FORMAT_CANDIDATES) {
+    if (swapped == candidate) return swapped;
+  }
+  return "";
+};
+
+// Get the field at index of a row, return false if there is none
+bool get_field(const std::string &row, char delim, int index,
+               std::string &field){
+  size_t start = 0;
+  for (int i = 0; i < index; ++i) {
+    start = row.find(delim, start);
+    if (start == std::string::npos) return false;
+    ++start;
+  }
+  size_t end = row.find(delim, start);
+  field = row.substr(start, end == std::string::npos ? end : end - start);
+  return true;
+};
+
+// Number of values that can be parsed with the parser
+template<typename Parser>
+int count_parsed(const std::vector<std::string> &values, Parser parser){
+  int count = 0;
+  for (auto iter = values.begin(); iter != values.end(); ++iter) {
+    if (parser(*iter)) ++count;
+  }
+  return count;
+};
+
+// Pick the timestamp and coordinate parsers from the first rows of the
+// file. A parser is picked if it handles more than half of the non-empty
+// samples, so that a few bad rows are left to the on_error mode. A time
+// format given by the user is always parsed with strptime.
+void infer_input_format(const std::vector<std::string> &rows,
+                        InputConfig &config){
+  std::vector<std::string> timestamps, coordinates;
+  std::string field;
+  for (auto iter = rows.begin(); iter != rows.end(); ++iter) {
+    if (get_field(*iter, config.delim, config.timestamp_idx, field) &&
+        !field.empty()) {
+      timestamps.push_back(field);
+    }
+    if (get_field(*iter, config.delim, config.x_idx, field) &&
+        !field.empty()) {
+      coordinates.push_back(field);
+    }
+    if (get_field(*iter, config.delim, config.y_idx, field) &&
+        !field.empty()) {
+      coordinates.push_back(field);
+    }
+  }
+  double value;
+  config.decimal_comma = false;
+  int num_coordinates = coordinates.size();
+  if (2 * count_parsed(coordinates, [&](const std::string &str){
+        return parse_double(str, value);}) <= num_coordinates &&
+      config.delim != ',' &&
+      2 * count_parsed(coordinates, [&](const std::string &str){
+        return parse_decimal_comma(str, value);}) > num_coordinates) {
+    config.decimal_comma = true;
+    std::cout<<"    Coordinates use decimal comma\n";
+  }
+  if (!config.time_format.empty()) {
+    config.time_layout = TimeLayout::STRPTIME;
+    return;
+  }
+  int num_timestamps = timestamps.size();
+  if (num_timestamps == 0) {
+    config.time_layout = TimeLayout::NUMERIC;
+    return;
+  }
+  // Candidates in order of preference, the one parsing most samples wins
+  int best_count = count_parsed(timestamps, [&](const std::string &str){
+    return parse_double(str, value);});
+  config.time_layout = TimeLayout::NUMERIC;
+  int count = count_parsed(timestamps, [&](const std::string &str){
+    return iso86012timestamp(str.c_str(), value);});
+  if (count > best_count) {
+    best_count = count;
+    config.time_layout = TimeLayout::ISO8601;
+  }
+  for (const char *format : TIME_FORMAT_CANDIDATES) {
+    count = count_parsed(timestamps, [&](const std::string &str){
+      return match_time_format(str, format);});
+    if (count > best_count) {
+      best_count = count;
+      config.time_layout = TimeLayout::STRPTIME;
+      config.time_format = format;
+    }
+  }
+  if (2 * best_count <= num_timestamps) {
+    std::cout<<"  Error: Time format not recognized from the first rows, "
+             <<"specify it with -f\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (config.time_layout == TimeLayout::STRPTIME) {
+    std::string swapped = day_month_swapped(config.time_format);
+    if (!swapped.empty() &&
+        count_parsed(timestamps, [&](const std::string &str){
+          return match_time_format(str, swapped.c_str());}) == best_count) {
+      std::cout<<"  Error: Time format is ambiguous between "
+               << config.time_format <<" and "<< swapped
+               <<", specify it with -f\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+  if (config.time_layout == TimeLayout::NUMERIC) {
+    for (auto iter = timestamps.begin(); iter != timestamps.end(); ++iter) {
+      if (parse_double(*iter, value)) {
+        if (std::fabs(value) > 1e11) {
+          std::cout<<"    Timestamps look like milliseconds, "
+                   <<"time gap is in the same unit\n";
+        }
+        break;
+      }
+    }
+    std::cout<<"    Time format detected: Unix timestamp\n";
+  } else if (config.time_layout == TimeLayout::ISO8601) {
+    std::cout<<"    Time format detected: ISO 8601\n";
+  } else {
+    std::cout<<"    Time format detected: "<< config.time_format <<"\n";
+  }
+};
+
+// Return NULL if the row is parsed, otherwise the reason of the error
+const char *read_row_to_point(std::string &row, InputConfig &config,
+                              std::string &traj_id, Point &p){
   // Parse fields from the input line
   std::stringstream ss(row);
   std::string intermediate;
@@ -218,28 +564,32 @@ void read_row_to_point(long long row_index, std::string &row,
       id_parsed = true;
     }
     if (index == config.x_idx) {
-      p.x = std::stod(intermediate);
+      if (!parse_coordinate(intermediate, config, p.x)) return "invalid x";
       x_parsed = true;
     }
     if (index == config.y_idx) {
-      p.y = std::stod(intermediate);
+      if (!parse_coordinate(intermediate, config, p.y)) return "invalid y";
       y_parsed = true;
     }
     if (index == config.timestamp_idx) {
       // std::cout<<"Timestamp "<< intermediate << "\n";
-      p.timestamp = string2timestamp(intermediate,config.time_format);
+      if (!parse_timestamp(intermediate, config, p.timestamp)) {
+        return "invalid timestamp";
+      }
       timestamp_parsed = true;
     }
     ++index;
   }
   if (!(id_parsed && x_parsed && y_parsed && timestamp_parsed)) {
-    std::cout<<"     Error in parsing row " << row_index << " "<< row << "\n";
-    std::exit(EXIT_FAILURE);
+    return "missing fields";
   }
+  return NULL;
 };
 
-void read_traj_data(std::ifstream &ifs, InputConfig &config,
-                    DataStore &ds, TrajIDMap &id_map){
+void read_traj_data(std::istream &ifs, InputConfig &config,
+                    const Projection &projection,
+                    DataStore &ds, TrajIDMap &id_map,
+                    RowErrorHandler &error_handler){
   std::cout<<"    Read gps data\n";
   long long num_traj;
   long long num_point;
@@ -251,24 +601,139 @@ void read_traj_data(std::ifstream &ifs, InputConfig &config,
   } else {
     read_header_config(config);
   }
+  // Sample the first rows to pick the parsers for the rest of the file
+  std::vector<std::string> sample_rows;
+  while ((int) sample_rows.size() < INPUT_FORMAT_SAMPLE_SIZE &&
+         std::getline(ifs, row)) {
+    sample_rows.push_back(row);
+  }
+  infer_input_format(sample_rows, config);
   long long progress = 0;
   // Ensure that the data is sorted in ascending order by time
-  while (std::getline(ifs, row)) {
+  while (true) {
+    if (progress < (long long) sample_rows.size()) {
+      row.swap(sample_rows[progress]);
+    } else if (!std::getline(ifs, row)) {
+      break;
+    }
     if (progress%1000000==0) {
       std::cout<<"    Lines read " << progress << "\n";
     }
     Point point;
     std::string traj_id;
-    read_row_to_point(progress, row, config, traj_id, point);
+    const char *error = read_row_to_point(row, config, traj_id, point);
+    if (error == NULL && !projectable(projection, point.x, point.y)) {
+      error = "point out of range of to_crs";
+    }
+    ++progress;
+    if (error != NULL) {
+      error_handler.report(progress + (config.header ? 1 : 0), error, row);
+      continue;
+    }
     // std::cout << "Point timestamp "<< point.timestamp << "\n";
     append_point(ds, id_map, traj_id, point);
-    ++progress;
   }
   std::cout<<"    Read gps data done with lines count "<<progress<<"\n";
+  if (error_handler.num_errors() > 0) {
+    std::cout<<"    Bad rows "<<error_handler.action()<<" "
+             <<error_handler.num_errors()<<"\n";
+  }
 };
 
+// Map a double to an unsigned key with the same ordering, so that
+// timestamps can be radix sorted.
+uint64_t timestamp2key(double timestamp){
+  // -0.0 and 0.0 compare equal, so they must get the same key
+  if (timestamp == 0) timestamp = 0;
+  uint64_t bits;
+  std::memcpy(&bits, &timestamp, sizeof(bits));
+  if (bits >> 63) {
+    return ~bits;
+  }
+  return bits | (uint64_t(1) << 63);
+};
+
+// Stable LSD radix sort on the timestamp key, 8 bits per pass. Passes
+// where all keys share the same digit (usually the high bytes of
+// timestamps) are skipped.
+void radix_sort_points(std::vector<Point> &geom){
+  size_t N = geom.size();
+  std::vector<uint64_t> keys(N);
+  std::vector<uint64_t> keys_buf(N);
+  std::vector<Point> geom_buf(N);
+  std::vector<size_t> counts(8*256, 0);
+  for (size_t i = 0; i < N; ++i) {
+    keys[i] = timestamp2key(geom[i].timestamp);
+    for (int d = 0; d < 8; ++d) {
+      ++counts[d*256 + ((keys[i] >> (8*d)) & 0xFF)];
+    }
+  }
+  for (int d = 0; d < 8; ++d) {
+    size_t *count = &counts[d*256];
+    if (count[(keys[0] >> (8*d)) & 0xFF] == N) continue;
+    size_t offset = 0;
+    for (int b = 0; b < 256; ++b) {
+      size_t c = count[b];
+      count[b] = offset;
+      offset += c;
+    }
+    for (size_t i = 0; i < N; ++i) {
+      size_t pos = count[(keys[i] >> (8*d)) & 0xFF]++;
+      keys_buf[pos] = keys[i];
+      geom_buf[pos] = geom[i];
+    }
+    keys.swap(keys_buf);
+    geom.swap(geom_buf);
+  }
+};
+
+// Merge the ascending runs of a nearly sorted trajectory pairwise,
+// which takes O(N log R) for R runs.
+void merge_sorted_runs(std::vector<Point> &geom){
+  std::vector<size_t> bounds;
+  bounds.push_back(0);
+  for (size_t i = 1; i < geom.size(); ++i) {
+    if (geom[i].timestamp < geom[i-1].timestamp) {
+      bounds.push_back(i);
+    }
+  }
+  bounds.push_back(geom.size());
+  while (bounds.size() > 2) {
+    std::vector<size_t> merged;
+    size_t i = 0;
+    for (; i + 2 < bounds.size(); i += 2) {
+      std::inplace_merge(geom.begin() + bounds[i], geom.begin() + bounds[i+1],
+                         geom.begin() + bounds[i+2], point_comp);
+      merged.push_back(bounds[i]);
+    }
+    for (; i < bounds.size(); ++i) {
+      merged.push_back(bounds[i]);
+    }
+    bounds.swap(merged);
+  }
+};
+
+// Sort points by timestamp. Points with the same timestamp keep their
+// input order whatever strategy is used.
 void sort_trajectory(Trajectory &traj){
-  std::sort(traj.geom.begin(), traj.geom.end(),point_comp);
+  long long N = traj.geom.size();
+  long long num_runs = traj.num_descents + 1;
+  if (traj.num_descents == 0) {
+    // Already sorted
+  } else if (num_runs <= 64 || num_runs * 16 <= N) {
+    merge_sorted_runs(traj.geom);
+  } else if (N >= 1024) {
+    radix_sort_points(traj.geom);
+  } else {
+    std::stable_sort(traj.geom.begin(), traj.geom.end(), point_comp);
+  }
+  traj.num_descents = 0;
+};
+
+void project_data_store(const Projection &proj, DataStore &ds){
+  for(auto iter=ds.begin(); iter!=ds.end(); ++iter) {
+    project_points(proj, iter->geom);
+  }
 };
 
 void sort_data_store(DataStore &ds){
@@ -278,9 +743,161 @@ void sort_data_store(DataStore &ds){
   }
 };
 
-void write_part_trip(std::ofstream &ofs,OutputConfig &config,
+// Checkpoint of a run, the sorted data store is saved as a binary image
+// after ingest and the write progress is recorded periodically, so that
+// a restarted run skips reading and resumes writing.
+
+struct WriteProgress {
+  long long traj_idx = 0; // index of the next trajectory to write
+  long long num_traj = 0;
+  long long num_point = 0;
+  long long num_stop = 0;
+  long long offset = 0; // bytes of output committed
+  long long stop_offset = 0; // bytes of stop output committed
+};
+
+struct Checkpoint {
+  std::string file;
+  std::string progress_file;
+  // Identifies the input file and arguments the checkpoint belongs to
+  std::string fingerprint;
+  long long interval; // bytes of output between two progress records
+  AsyncWriteBuf *obuf = NULL;
+  AsyncWriteBuf *stop_obuf = NULL;
+  long long last_offset = 0;
+};
+
+const char CHECKPOINT_MAGIC[8] = {'G','P','S','2','T','R','J','1'};
+
+std::string checkpoint_fingerprint(const std::string &input_file,
+                                   int argc, char **argv){
+  struct stat buf;
+  stat(input_file.c_str(), &buf);
+  std::stringstream ss;
+  ss<<buf.st_size<<" "<<buf.st_mtime;
+  for (int i = 1; i < argc; ++i) {
+    ss<<" "<<argv[i];
+  }
+  return ss.str();
+};
+
+// Write to a temporary file and rename it, so that a crash never
+// leaves a partial checkpoint behind.
+bool commit_file(FILE *fp, const std::string &tmp_file,
+                 const std::string &filename){
+  bool ok = (std::fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+  ok = (std::fclose(fp) == 0) && ok;
+  return ok && std::rename(tmp_file.c_str(), filename.c_str()) == 0;
+};
+
+bool write_string(FILE *fp, const std::string &str){
+  uint64_t size = str.size();
+  return std::fwrite(&size, sizeof(size), 1, fp) == 1 &&
+         std::fwrite(str.data(), 1, size, fp) == size;
+};
+
+bool read_string(FILE *fp, std::string &str){
+  uint64_t size;
+  if (std::fread(&size, sizeof(size), 1, fp) != 1) return false;
+  str.resize(size);
+  return std::fread(&str[0], 1, size, fp) == size;
+};
+
+bool save_data_store(const Checkpoint &ckpt, const DataStore &ds){
+  std::string tmp_file = ckpt.file + ".tmp";
+  FILE *fp = std::fopen(tmp_file.c_str(), "wb");
+  if (fp == NULL) return false;
+  uint64_t num_trajs = ds.size();
+  bool ok = std::fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC), 1, fp) == 1
+            && write_string(fp, ckpt.fingerprint)
+            && std::fwrite(&num_trajs, sizeof(num_trajs), 1, fp) == 1;
+  for (auto iter = ds.begin(); ok && iter != ds.end(); ++iter) {
+    uint64_t num_points = iter->geom.size();
+    ok = write_string(fp, iter->id)
+         && std::fwrite(&num_points, sizeof(num_points), 1, fp) == 1
+         && std::fwrite(iter->geom.data(), sizeof(Point), num_points, fp)
+            == num_points;
+  }
+  if (!ok) {
+    std::fclose(fp);
+    return false;
+  }
+  return commit_file(fp, tmp_file, ckpt.file);
+};
+
+bool load_data_store(const Checkpoint &ckpt, DataStore &ds){
+  FILE *fp = std::fopen(ckpt.file.c_str(), "rb");
+  if (fp == NULL) return false;
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  std::string fingerprint;
+  uint64_t num_trajs;
+  bool ok = std::fread(magic, sizeof(magic), 1, fp) == 1
+            && std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0
+            && read_string(fp, fingerprint)
+            && fingerprint == ckpt.fingerprint
+            && std::fread(&num_trajs, sizeof(num_trajs), 1, fp) == 1;
+  if (ok) {
+    ds.resize(num_trajs);
+  }
+  for (auto iter = ds.begin(); ok && iter != ds.end(); ++iter) {
+    uint64_t num_points;
+    ok = read_string(fp, iter->id)
+         && std::fread(&num_points, sizeof(num_points), 1, fp) == 1;
+    if (ok) {
+      iter->geom.resize(num_points);
+      ok = std::fread(iter->geom.data(), sizeof(Point), num_points, fp)
+           == num_points;
+    }
+  }
+  std::fclose(fp);
+  if (!ok) {
+    ds.clear();
+  }
+  return ok;
+};
+
+bool save_write_progress(const Checkpoint &ckpt, const WriteProgress &wp){
+  std::string tmp_file = ckpt.progress_file + ".tmp";
+  FILE *fp = std::fopen(tmp_file.c_str(), "w");
+  if (fp == NULL) return false;
+  std::fprintf(fp, "%s\n%lld %lld %lld %lld %lld %lld\n",
+               ckpt.fingerprint.c_str(), wp.traj_idx, wp.num_traj,
+               wp.num_point, wp.num_stop, wp.offset, wp.stop_offset);
+  return commit_file(fp, tmp_file, ckpt.progress_file);
+};
+
+bool load_write_progress(const Checkpoint &ckpt, WriteProgress &wp){
+  std::ifstream ifs(ckpt.progress_file);
+  std::string fingerprint;
+  if (!std::getline(ifs, fingerprint) || fingerprint != ckpt.fingerprint) {
+    return false;
+  }
+  return static_cast<bool>(
+    ifs >> wp.traj_idx >> wp.num_traj >> wp.num_point >> wp.num_stop
+        >> wp.offset >> wp.stop_offset);
+};
+
+// Make the output written so far durable and record how far it goes
+void commit_write_progress(Checkpoint &ckpt, WriteProgress wp){
+  if (!ckpt.obuf->commit() ||
+      (ckpt.stop_obuf != NULL && !ckpt.stop_obuf->commit())) {
+    std::cout<<"  Error: Failed to write output file\n";
+    std::exit(EXIT_FAILURE);
+  }
+  wp.offset = ckpt.obuf->tell();
+  if (ckpt.stop_obuf != NULL) {
+    wp.stop_offset = ckpt.stop_obuf->tell();
+  }
+  if (!save_write_progress(ckpt, wp)) {
+    std::cout<<"    Warning: Failed to save write progress to "
+             << ckpt.progress_file << "\n";
+  }
+  ckpt.last_offset = wp.offset;
+};
+
+void write_part_trip(std::ostream &ofs,OutputConfig &config,
                      int traj_idx, Trajectory &traj,
-                     int start_idx, int end_idx){
+                     int start_idx, int end_idx, const TripStats &stats){
   ofs<<traj_idx<<";"<<traj.id<<";";
   ofs<<"LineString(";
   for (int i = start_idx; i<=end_idx; ++i) {
@@ -299,30 +916,116 @@ void write_part_trip(std::ofstream &ofs,OutputConfig &config,
       ofs<<traj.geom[j].timestamp<<(j==end_idx ? "" : ",");
     }
   }
+  double duration = traj.geom[end_idx].timestamp -
+    traj.geom[start_idx].timestamp;
+  if (config.write_npoints){
+    ofs<<";"<<end_idx-start_idx+1;
+  }
+  if (config.write_length){
+    ofs<<";"<<stats.length;
+  }
+  if (config.write_duration){
+    ofs<<";"<<duration;
+  }
+  if (config.write_mean_speed){
+    ofs<<";"<<(duration > 0 ? stats.length/duration : 0);
+  }
+  if (config.write_max_speed){
+    ofs<<";"<<stats.max_speed;
+  }
+  if (config.write_min_interval){
+    ofs<<";"<<stats.min_interval;
+  }
+  if (config.write_mean_interval){
+    ofs<<";"<<duration/(end_idx-start_idx);
+  }
+  if (config.write_max_interval){
+    ofs<<";"<<stats.max_interval;
+  }
   ofs<<"\n";
 };
 
-void write_traj_data(std::ofstream &ofs, OutputConfig &config,
-                     DataStore &ds, TrajIDMap &id_map,
+// Write trip [start_idx, end_idx] if it contains at least two points
+void write_trip(std::ostream &ofs, OutputConfig &config, Trajectory &traj,
+                int start_idx, int end_idx, const TripStats &stats,
+                long long& num_traj, long long& num_point){
+  if (end_idx <= start_idx) return;
+  num_traj+=1;
+  num_point+=end_idx-start_idx+1;
+  write_part_trip(ofs, config, num_traj, traj, start_idx, end_idx, stats);
+};
+
+void write_stop(std::ostream *sfs, Trajectory &traj,
+                int start_idx, int end_idx, long long &num_stop){
+  num_stop+=1;
+  if (sfs == NULL) return;
+  double x = 0, y = 0;
+  for (int i = start_idx; i<=end_idx; ++i) {
+    x += traj.geom[i].x;
+    y += traj.geom[i].y;
+  }
+  int n = end_idx-start_idx+1;
+  *sfs<<num_stop<<";"<<traj.id<<";"<<x/n<<";"<<y/n<<";"
+      <<traj.geom[start_idx].timestamp<<";"<<traj.geom[end_idx].timestamp<<";"
+      <<n<<"\n";
+};
+
+// Write trajectories from first_idx on, the header is written only when
+// starting from the first one. If checkpoint is not NULL, write progress
+// is committed every checkpoint->interval bytes.
+void write_traj_data(std::ostream &ofs, OutputConfig &config,
+                     DataStore &ds, long long first_idx,
                      double time_gap, double dist_gap,
-                     long long& num_traj, long long& num_point){
+                     const StopConfig &stop_config, std::ostream *sfs,
+                     long long& num_traj, long long& num_point,
+                     long long& num_stop, Checkpoint *checkpoint){
   long long total_id_count = ds.size();
   std::cout<< "    Total distinct id to write " << total_id_count << "\n";
   long long step = total_id_count/10;
   if (step<1) step = 1;
-  ofs<<"index;id;geom";
-  if (config.write_ts){
-    ofs<<";ts";
-  }
-  if (config.write_tend){
-    ofs<<";tend";
-  }
-  if (config.write_timestamp){
-    ofs<<";timestamp";
+  if (first_idx == 0) {
+    ofs<<"index;id;geom";
+    if (config.write_ts){
+      ofs<<";ts";
+    }
+    if (config.write_tend){
+      ofs<<";tend";
+    }
+    if (config.write_timestamp){
+      ofs<<";timestamp";
+    }
+    if (config.write_npoints){
+      ofs<<";npoints";
+    }
+    if (config.write_length){
+      ofs<<";length";
+    }
+    if (config.write_duration){
+      ofs<<";duration";
+    }
+    if (config.write_mean_speed){
+      ofs<<";mean_speed";
+    }
+    if (config.write_max_speed){
+      ofs<<";max_speed";
+    }
+    if (config.write_min_interval){
+      ofs<<";min_interval";
+    }
+    if (config.write_mean_interval){
+      ofs<<";mean_interval";
+    }
+    if (config.write_max_interval){
+      ofs<<";max_interval";
+    }
+    ofs<<"\n";
+    if (sfs != NULL) {
+      *sfs<<"index;id;x;y;tstart;tend;npoints\n";
+    }
   }
-  ofs<<"\n";
-  long long progress = 0;
-  for(auto iter=ds.begin(); iter!=ds.end(); ++iter) {
+  double stop_radius2 = stop_config.radius*stop_config.radius;
+  long long progress = first_idx;
+  for(auto iter=ds.begin()+first_idx; iter!=ds.end(); ++iter) {
     // write_traj_to_stream(ofs, *iter, time_gap, dist_gap);
     // Write traj to stream
     if (progress%step==0){
@@ -332,27 +1035,61 @@ void write_traj_data(std::ofstream &ofs, OutputConfig &config,
     // Iterate current and next point
     int N = traj.geom.size();
     int start_idx = 0;
-    int end_idx = 0;
+    // First point of the candidate stop and the trip stats up to it
+    int anchor_idx = 0;
+    TripStats stats;
+    TripStats anchor_stats;
+    reset_trip_stats(stats);
+    reset_trip_stats(anchor_stats);
     for (int i=0; i<N-1; ++i) {
-      end_idx = i+1;
       double time_diff = traj.geom[i+1].timestamp-traj.geom[i].timestamp;
       double distance = std::sqrt(std::pow(traj.geom[i+1].x-traj.geom[i].x,2)+
                                   std::pow(traj.geom[i+1].y-traj.geom[i].y,2));
-      if(time_diff>time_gap || distance>dist_gap) {
-        if (end_idx-1>start_idx){
-          num_traj+=1;
-          num_point+=end_idx-start_idx;
-          write_part_trip(ofs, config, num_traj, traj, start_idx, end_idx-1);
+      bool gap = time_diff>time_gap || distance>dist_gap;
+      if (stop_config.enabled() && (gap ||
+          std::pow(traj.geom[i+1].x-traj.geom[anchor_idx].x,2)+
+          std::pow(traj.geom[i+1].y-traj.geom[anchor_idx].y,2)>stop_radius2)) {
+        // Point i+1 leaves the candidate stop [anchor_idx, i]
+        if (traj.geom[i].timestamp-traj.geom[anchor_idx].timestamp>=
+            stop_config.duration) {
+          write_trip(ofs, config, traj, start_idx, anchor_idx, anchor_stats,
+                     num_traj, num_point);
+          write_stop(sfs, traj, anchor_idx, i, num_stop);
+          start_idx = i;
+          reset_trip_stats(stats);
         }
-        start_idx = end_idx;
+        anchor_idx = i+1;
+      }
+      if (gap) {
+        write_trip(ofs, config, traj, start_idx, i, stats,
+                   num_traj, num_point);
+        start_idx = i+1;
+        reset_trip_stats(stats);
+        reset_trip_stats(anchor_stats);
+      } else {
+        update_trip_stats(stats, time_diff, distance);
+        if (anchor_idx == i+1) anchor_stats = stats;
       }
     }
-    if (end_idx>start_idx){
-      num_traj+=1;
-      num_point+=end_idx-start_idx+1;
-      write_part_trip(ofs, config, num_traj, traj, start_idx, end_idx);
+    if (stop_config.enabled() && N>0 &&
+        traj.geom[N-1].timestamp-traj.geom[anchor_idx].timestamp>=
+        stop_config.duration) {
+      write_trip(ofs, config, traj, start_idx, anchor_idx, anchor_stats,
+                 num_traj, num_point);
+      write_stop(sfs, traj, anchor_idx, N-1, num_stop);
+      start_idx = N-1;
     }
+    write_trip(ofs, config, traj, start_idx, N-1, stats, num_traj, num_point);
     ++progress;
+    if (checkpoint != NULL && checkpoint->obuf->tell() -
+        checkpoint->last_offset >= checkpoint->interval) {
+      WriteProgress wp;
+      wp.traj_idx = progress;
+      wp.num_traj = num_traj;
+      wp.num_point = num_point;
+      wp.num_stop = num_stop;
+      commit_write_progress(*checkpoint, wp);
+    }
   }
 };
 
@@ -374,11 +1111,20 @@ void print_help(){
   std::cout<<"-x/--x: x column name or index (x by default)\n";
   std::cout<<"-y/--y: y column name or index (y by default)\n";
   std::cout<<"-t/--time: time column name or index (timestamp by default)\n";
-  std::cout<<"-f/--tf: time format(0 for int, 1 for 2020-01-01T00:00:27)\n";
+  std::cout<<"-f/--tf: time format as strftime template, detected from the first rows by default\n";
   std::cout<<"--time_gap: time gap to split long trajectory \n";
   std::cout<<"--dist_gap: dist gap to split long trajectory \n";
+  std::cout<<"--to_crs: project lon/lat to EPSG:3857 or UTM EPSG:326xx/327xx before splitting, rows that cannot be projected (e.g., poles) are bad rows, disabled by default\n";
+  std::cout<<"--stop_radius: radius of a stop splitting trajectory, 0 to disable stop detection (0 by default)\n";
+  std::cout<<"--stop_duration: minimum duration of a stop, positive (300 by default)\n";
+  std::cout<<"--stop_output: file storing the detected stops, disabled by default\n";
   std::cout<<"--no_header: if specified, gps file contains no header\n";
-  std::cout<<"--ofields: output fields (ts,tend,timestamp) separated by , default no output fields\n";
+  std::cout<<"--ofields: output fields (ts,tend,timestamp,npoints,length,duration,mean_speed,max_speed,min_interval,mean_interval,max_interval) separated by , default no output fields\n";
+  std::cout<<"--on_error: action on a malformed row (fail, skip, reject), fail by default\n";
+  std::cout<<"--max_errors: maximum number of bad rows in skip/reject mode, negative for no limit (1000 by default)\n";
+  std::cout<<"--reject_file: file storing bad rows in reject mode (output file + .reject by default)\n";
+  std::cout<<"--checkpoint: checkpoint file to resume an interrupted run, disabled by default\n";
+  std::cout<<"--checkpoint_interval: MB of output between two write progress records (64 by default)\n";
   std::cout<<"-h/--help: print help information\n";
 };
 
@@ -400,8 +1146,16 @@ int main(int argc, char**argv){
   int opt;
   double dist_gap=1e9;
   double time_gap=1e9;
+  StopConfig stop_config;
+  Projection projection;
+  std::string stop_file;
   // int time_format = 0;
   std::string time_format="";
+  ErrorMode error_mode = ErrorMode::FAIL;
+  long long max_errors = 1000;
+  std::string reject_file;
+  std::string checkpoint_file;
+  double checkpoint_interval = 64;
   // The last element of the array has to be filled with zeros.
   static struct option long_options[] =
   {
@@ -416,7 +1170,16 @@ int main(int argc, char**argv){
     {"time_gap",   required_argument,0, 0},
     {"ofields",   required_argument,0, 0},
     {"dist_gap",   required_argument,0, 0},
+    {"to_crs",   required_argument,0, 0},
+    {"stop_radius",   required_argument,0, 0},
+    {"stop_duration",   required_argument,0, 0},
+    {"stop_output",   required_argument,0, 0},
     {"no_header",   no_argument, 0, 0},
+    {"on_error",   required_argument,0, 0},
+    {"max_errors",   required_argument,0, 0},
+    {"reject_file",   required_argument,0, 0},
+    {"checkpoint",   required_argument,0, 0},
+    {"checkpoint_interval",   required_argument,0, 0},
     {"help",   no_argument,0,'h' },
     {0,         0,                 0,  0 }
   };
@@ -461,12 +1224,49 @@ int main(int argc, char**argv){
       if (strcmp(long_options[long_index].name,"dist_gap")==0){
         dist_gap = std::atof(optarg);
       }
+      if (strcmp(long_options[long_index].name,"to_crs")==0){
+        if (!parse_crs(optarg, projection)) {
+          std::cout<<"  Error: Unsupported CRS: "<< optarg <<"\n";
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      if (strcmp(long_options[long_index].name,"stop_radius")==0){
+        stop_config.radius = std::atof(optarg);
+      }
+      if (strcmp(long_options[long_index].name,"stop_duration")==0){
+        stop_config.duration = std::atof(optarg);
+        if (stop_config.duration <= 0) {
+          std::cout<<"  Error: stop_duration should be positive\n";
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      if (strcmp(long_options[long_index].name,"stop_output")==0){
+        stop_file = std::string(optarg);
+      }
       if (strcmp(long_options[long_index].name,"no_header")==0){
         header = false;
       }
       if (strcmp(long_options[long_index].name,"ofields")==0){
         output_fields = std::string(optarg);
       }
+      if (strcmp(long_options[long_index].name,"on_error")==0){
+        if (!parse_error_mode(optarg, error_mode)) {
+          std::cout<<"  Error: Unknown on_error mode: "<< optarg <<"\n";
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      if (strcmp(long_options[long_index].name,"max_errors")==0){
+        max_errors = std::atoll(optarg);
+      }
+      if (strcmp(long_options[long_index].name,"reject_file")==0){
+        reject_file = std::string(optarg);
+      }
+      if (strcmp(long_options[long_index].name,"checkpoint")==0){
+        checkpoint_file = std::string(optarg);
+      }
+      if (strcmp(long_options[long_index].name,"checkpoint_interval")==0){
+        checkpoint_interval = std::atof(optarg);
+      }
       break;
     default:
       print_help();
@@ -491,42 +1291,158 @@ int main(int argc, char**argv){
   std::cout<<"    ofields: "<< output_fields <<"\n";
   std::cout<<"    time gap: "<< time_gap <<"\n";
   std::cout<<"    dist gap: "<< dist_gap <<"\n";
+  if (projection.type != Projection::NONE) {
+    std::cout<<"    to crs: EPSG:"<< projection.epsg <<"\n";
+  }
+  if (stop_config.enabled()) {
+    std::cout<<"    stop radius: "<< stop_config.radius <<"\n";
+    std::cout<<"    stop duration: "<< stop_config.duration <<"\n";
+    std::cout<<"    stop output: "<< stop_file <<"\n";
+  } else if (!stop_file.empty()) {
+    std::cout<<"  Error: stop_output requires stop_radius to be positive\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (reject_file.empty()) {
+    reject_file = output_file + ".reject";
+  }
+  std::cout<<"    on error: "<< error_mode2string(error_mode) <<"\n";
+  if (error_mode != ErrorMode::FAIL) {
+    std::cout<<"    max errors: "<< max_errors <<"\n";
+  }
+  if (error_mode == ErrorMode::REJECT) {
+    std::cout<<"    reject file: "<< reject_file <<"\n";
+  }
+  if (!checkpoint_file.empty()) {
+    std::cout<<"    checkpoint: "<< checkpoint_file <<"\n";
+    std::cout<<"    checkpoint interval: "<< checkpoint_interval <<" MB\n";
+  }
   auto t1 = std::chrono::high_resolution_clock::now();
   long long num_traj = 0;
   long long num_point = 0;
   DataStore ds;
   TrajIDMap id_map;
   InputConfig input_config{
-    id_name,x_name,y_name,timestamp_name,-1,-1,-1,-1,delim, header, time_format
+    id_name,x_name,y_name,timestamp_name,-1,-1,-1,-1,delim, header, time_format,
+    TimeLayout::NUMERIC, false
   };
   OutputConfig output_config;
   parse_ofields(output_config, output_fields);
-  std::cout<<"---- Reading GPS data ----\n";
-  std::ifstream ifs(input_file);
-  read_traj_data(ifs, input_config, ds, id_map);
+  Checkpoint checkpoint;
+  bool resumed = false;
+  WriteProgress write_progress;
+  if (!checkpoint_file.empty()) {
+    checkpoint.file = checkpoint_file;
+    checkpoint.progress_file = checkpoint_file + ".progress";
+    checkpoint.fingerprint = checkpoint_fingerprint(input_file, argc, argv);
+    checkpoint.interval = checkpoint_interval * 1024 * 1024;
+    if (check_file_exist(checkpoint.file)) {
+      resumed = load_data_store(checkpoint, ds);
+      if (resumed) {
+        std::cout<<"---- Resumed from checkpoint "<< checkpoint.file
+                 <<" ----\n";
+      } else {
+        std::cout<<"    Checkpoint does not match this run, ignored\n";
+      }
+    }
+  }
+  if (!resumed) {
+    std::cout<<"---- Reading GPS data ----\n";
+    AsyncReadBuf ibuf(input_file);
+    std::istream ifs(&ibuf);
+    RowErrorHandler error_handler(error_mode, max_errors, reject_file);
+    read_traj_data(ifs, input_config, projection, ds, id_map, error_handler);
+    if (ibuf.failed()) {
+      std::cout<<"  Error: Failed to read input file: "<< input_file <<"\n";
+      std::exit(EXIT_FAILURE);
+    }
+    if (projection.type != Projection::NONE) {
+      std::cout<<"    Project points to EPSG:"<< projection.epsg <<"\n";
+      project_data_store(projection, ds);
+    }
+  }
   auto t2 = std::chrono::high_resolution_clock::now();
   auto input_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     t2 - t1 ).count();
   std::cout<<"Reading input takes " << input_duration << " ms\n";
-  std::cout<<"---- Sorting points in trajectory ----\n";
-  sort_data_store(ds);
+  if (!resumed) {
+    std::cout<<"---- Sorting points in trajectory ----\n";
+    sort_data_store(ds);
+    if (!checkpoint_file.empty() && !save_data_store(checkpoint, ds)) {
+      std::cout<<"    Warning: Failed to save checkpoint "
+               << checkpoint.file << "\n";
+    }
+  }
   auto t3 = std::chrono::high_resolution_clock::now();
   auto sort_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     t3 - t2 ).count();
   std::cout<<"Sorting points takes " << sort_duration << " ms\n";
   std::cout<<"---- Writing trajectory data ----\n";
-  std::ofstream ofs(output_file);
+  if (resumed && load_write_progress(checkpoint, write_progress)) {
+    struct stat buf;
+    struct stat stop_buf;
+    if (stat(output_file.c_str(), &buf) == 0 &&
+        buf.st_size >= write_progress.offset &&
+        (stop_file.empty() ||
+         (stat(stop_file.c_str(), &stop_buf) == 0 &&
+          stop_buf.st_size >= write_progress.stop_offset)) &&
+        write_progress.traj_idx <= (long long) ds.size()) {
+      std::cout<<"    Resume writing from trajectory "
+               << write_progress.traj_idx << "\n";
+    } else {
+      write_progress = WriteProgress();
+    }
+  }
+  num_traj = write_progress.num_traj;
+  num_point = write_progress.num_point;
+  long long num_stop = write_progress.num_stop;
+  AsyncWriteBuf obuf(output_file, write_progress.offset);
+  if (!obuf.is_open()) {
+    std::cout<<"  Error: Output file cannot be opened: "<< output_file <<"\n";
+    std::exit(EXIT_FAILURE);
+  }
+  std::ostream ofs(&obuf);
   ofs.precision(12);
-  write_traj_data(ofs, output_config, ds, id_map, time_gap, dist_gap,
-    num_traj, num_point);
+  std::unique_ptr<AsyncWriteBuf> stop_obuf;
+  std::unique_ptr<std::ostream> sfs;
+  if (!stop_file.empty()) {
+    stop_obuf.reset(new AsyncWriteBuf(stop_file, write_progress.stop_offset));
+    if (!stop_obuf->is_open()) {
+      std::cout<<"  Error: Stop file cannot be opened: "<< stop_file <<"\n";
+      std::exit(EXIT_FAILURE);
+    }
+    sfs.reset(new std::ostream(stop_obuf.get()));
+    sfs->precision(12);
+  }
+  checkpoint.obuf = &obuf;
+  checkpoint.stop_obuf = stop_obuf.get();
+  checkpoint.last_offset = write_progress.offset;
+  write_traj_data(ofs, output_config, ds, write_progress.traj_idx,
+    time_gap, dist_gap, stop_config, sfs.get(), num_traj, num_point, num_stop,
+    checkpoint_file.empty() ? NULL : &checkpoint);
+  if (!ofs.flush()) {
+    std::cout<<"  Error: Failed to write output file: "<< output_file <<"\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (sfs && !sfs->flush()) {
+    std::cout<<"  Error: Failed to write stop file: "<< stop_file <<"\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (!checkpoint_file.empty()) {
+    // The run is complete, the checkpoint is not needed any more
+    std::remove(checkpoint.file.c_str());
+    std::remove(checkpoint.progress_file.c_str());
+  }
   auto t4 = std::chrono::high_resolution_clock::now();
   auto write_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     t4 - t3 ).count();
   std::cout<<"Write output takes " << write_duration << " ms\n";
   std::cout<<"---- gps2traj statistcs ----\n";
-  std::cout<<"    Distinct ids "<< id_map.size() <<"\n";
+  std::cout<<"    Distinct ids "<< ds.size() <<"\n";
   std::cout<<"    Number of trips "<< num_traj <<"\n";
   std::cout<<"    Number of points "<< num_point <<"\n";
+  if (stop_config.enabled()) {
+    std::cout<<"    Number of stops "<< num_stop <<"\n";
+  }
   auto t5 = std::chrono::high_resolution_clock::now();
   auto whole_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     t5 - t1 ).count();
@@ -0,0 +1,155 @@
+// Author: Can Yang
+// Email : cyang@kth.se
+//
+// Built-in map projections of WGS84 longitude/latitude, Web Mercator
+// (EPSG:3857) and UTM (EPSG:326xx north, EPSG:327xx south). UTM uses
+// the Krueger series of the transverse Mercator projection, which is
+// accurate to well below a millimeter within a zone.
+
+#ifndef GPS2TRAJ_PROJECTION_HPP
+#define GPS2TRAJ_PROJECTION_HPP
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+
+const double WGS84_A = 6378137.0;
+const double WGS84_F = 1 / 298.257223563;
+const double DEG2RAD = M_PI / 180;
+
+struct Projection {
+  enum Type {NONE, WEB_MERCATOR, UTM};
+  Type type = NONE;
+  int epsg = 0;
+  // UTM parameters
+  double lon0 = 0; // central meridian in radians
+  double false_northing = 0;
+  double k0A = 0;
+  double e2n = 0; // 2 sqrt(n) / (1 + n)
+  double alpha[3];
+  double beta[3];
+  double delta[3];
+};
+
+inline void init_utm(Projection &proj, int zone, bool south){
+  double n = WGS84_F / (2 - WGS84_F);
+  double n2 = n * n, n3 = n2 * n;
+  proj.type = Projection::UTM;
+  proj.lon0 = (zone * 6 - 183) * DEG2RAD;
+  proj.false_northing = south ? 1e7 : 0;
+  proj.k0A = 0.9996 * WGS84_A / (1 + n) * (1 + n2 / 4 + n2 * n2 / 64);
+  proj.e2n = 2 * std::sqrt(n) / (1 + n);
+  proj.alpha[0] = n / 2 - 2 * n2 / 3 + 5 * n3 / 16;
+  proj.alpha[1] = 13 * n2 / 48 - 3 * n3 / 5;
+  proj.alpha[2] = 61 * n3 / 240;
+  proj.beta[0] = n / 2 - 2 * n2 / 3 + 37 * n3 / 96;
+  proj.beta[1] = n2 / 48 + n3 / 15;
+  proj.beta[2] = 17 * n3 / 480;
+  proj.delta[0] = 2 * n - 2 * n2 / 3 - 2 * n3;
+  proj.delta[1] = 7 * n2 / 3 - 8 * n3 / 5;
+  proj.delta[2] = 56 * n3 / 15;
+};
+
+// Parse a CRS given as EPSG:code or code, return false if unsupported
+inline bool parse_crs(const std::string &str, Projection &proj){
+  std::string code = str;
+  if (code.size() > 5 && std::toupper(code[0]) == 'E' &&
+      std::toupper(code[1]) == 'P' && std::toupper(code[2]) == 'S' &&
+      std::toupper(code[3]) == 'G' && code[4] == ':') {
+    code = code.substr(5);
+  }
+  char *end;
+  long epsg = std::strtol(code.c_str(), &end, 10);
+  if (code.empty() || *end != '\0') return false;
+  if (epsg == 3857) {
+    proj.type = Projection::WEB_MERCATOR;
+  } else if ((epsg > 32600 && epsg <= 32660) ||
+             (epsg > 32700 && epsg <= 32760)) {
+    init_utm(proj, epsg % 100, epsg > 32700);
+  } else {
+    return false;
+  }
+  proj.epsg = epsg;
+  return true;
+};
+
+// False if the point has no finite image, the poles in both projections
+// and, in UTM, points a quarter turn or more from the central meridian.
+inline bool projectable(const Projection &proj, double lon, double lat){
+  if (proj.type == Projection::NONE) return true;
+  if (!(std::fabs(lat) < 90)) return false;
+  if (proj.type == Projection::UTM) {
+    return std::cos(lon * DEG2RAD - proj.lon0) > 0;
+  }
+  return true;
+};
+
+// Project longitude/latitude in degrees to x/y in meters in place,
+// one tight loop over the points of a trajectory.
+template<typename P>
+void project_points(const Projection &proj, std::vector<P> &pts){
+  size_t N = pts.size();
+  if (proj.type == Projection::WEB_MERCATOR) {
+    for (size_t i = 0; i < N; ++i) {
+      double lat = pts[i].y * DEG2RAD;
+      pts[i].x = WGS84_A * pts[i].x * DEG2RAD;
+      pts[i].y = WGS84_A * std::log(std::tan(M_PI / 4 + lat / 2));
+    }
+  } else if (proj.type == Projection::UTM) {
+    for (size_t i = 0; i < N; ++i) {
+      double lat = pts[i].y * DEG2RAD;
+      double dlon = pts[i].x * DEG2RAD - proj.lon0;
+      double sin_lat = std::sin(lat);
+      double t = std::sinh(std::atanh(sin_lat) -
+                           proj.e2n * std::atanh(proj.e2n * sin_lat));
+      double xi = std::atan2(t, std::cos(dlon));
+      double eta = std::atanh(std::sin(dlon) / std::sqrt(1 + t * t));
+      double e = eta, n = xi;
+      for (int j = 0; j < 3; ++j) {
+        double k = 2 * (j + 1);
+        e += proj.alpha[j] * std::cos(k * xi) * std::sinh(k * eta);
+        n += proj.alpha[j] * std::sin(k * xi) * std::cosh(k * eta);
+      }
+      pts[i].x = 500000 + proj.k0A * e;
+      pts[i].y = proj.false_northing + proj.k0A * n;
+    }
+  }
+};
+
+// Inverse of project_points, x/y in meters to longitude/latitude
+template<typename P>
+void unproject_points(const Projection &proj, std::vector<P> &pts){
+  size_t N = pts.size();
+  if (proj.type == Projection::WEB_MERCATOR) {
+    for (size_t i = 0; i < N; ++i) {
+      pts[i].x = pts[i].x / WGS84_A / DEG2RAD;
+      pts[i].y = (2 * std::atan(std::exp(pts[i].y / WGS84_A)) - M_PI / 2)
+                 / DEG2RAD;
+    }
+  } else if (proj.type == Projection::UTM) {
+    for (size_t i = 0; i < N; ++i) {
+      double xi = (pts[i].y - proj.false_northing) / proj.k0A;
+      double eta = (pts[i].x - 500000) / proj.k0A;
+      double xi1 = xi, eta1 = eta;
+      for (int j = 0; j < 3; ++j) {
+        double k = 2 * (j + 1);
+        xi1 -= proj.beta[j] * std::sin(k * xi) * std::cosh(k * eta);
+        eta1 -= proj.beta[j] * std::cos(k * xi) * std::sinh(k * eta);
+      }
+      double chi = std::asin(std::sin(xi1) / std::cosh(eta1));
+      double lat = chi;
+      for (int j = 0; j < 3; ++j) {
+        lat += proj.delta[j] * std::sin(2 * (j + 1) * chi);
+      }
+      // Wrap into [-180, 180], lon0 + dlon leaves it near the antimeridian
+      pts[i].x = std::remainder(
+        (proj.lon0 + std::atan2(std::sinh(eta1), std::cos(xi1))) / DEG2RAD,
+        360.0);
+      pts[i].y = lat / DEG2RAD;
+    }
+  }
+};
+
+#endif // GPS2TRAJ_PROJECTION_HPP
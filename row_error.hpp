@@ -0,0 +1,103 @@
+// Author: Can Yang
+// Email : cyang@kth.se
+//
+// Handling of malformed input rows. Parsers report a failed row with a
+// static reason string instead of exiting, and RowErrorHandler decides
+// whether to stop, skip the row or write it to a reject file.
+
+#ifndef GPS2TRAJ_ROW_ERROR_HPP
+#define GPS2TRAJ_ROW_ERROR_HPP
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cctype>
+
+enum class ErrorMode {FAIL, SKIP, REJECT};
+
+// Parse a double without exceptions. Leading and trailing whitespace is
+// accepted (e.g., \r of CRLF files), any other trailing char is an error.
+inline bool parse_double(const char *str, double &value){
+  char *end;
+  value = std::strtod(str, &end);
+  if (end == str) return false;
+  while (std::isspace(static_cast<unsigned char>(*end))) ++end;
+  return *end == '\0';
+};
+
+inline bool parse_double(const std::string &str, double &value){
+  return parse_double(str.c_str(), value);
+};
+
+inline bool parse_error_mode(const std::string &str, ErrorMode &mode){
+  if (str == "fail") {
+    mode = ErrorMode::FAIL;
+  } else if (str == "skip") {
+    mode = ErrorMode::SKIP;
+  } else if (str == "reject") {
+    mode = ErrorMode::REJECT;
+  } else {
+    return false;
+  }
+  return true;
+};
+
+inline const char *error_mode2string(ErrorMode mode){
+  switch (mode) {
+  case ErrorMode::SKIP: return "skip";
+  case ErrorMode::REJECT: return "reject";
+  default: return "fail";
+  }
+};
+
+class RowErrorHandler {
+public:
+  RowErrorHandler(ErrorMode mode, long long max_errors,
+                  const std::string &reject_file) :
+    mode_(mode), max_errors_(max_errors), num_errors_(0) {
+    if (mode_ == ErrorMode::REJECT) {
+      rfs_.open(reject_file);
+      if (!rfs_.is_open()) {
+        std::cout<<"  Error: Reject file cannot be opened: "
+                 << reject_file <<"\n";
+        std::exit(EXIT_FAILURE);
+      }
+      rfs_<<"line;reason;row"<<std::endl;
+    }
+  };
+  // Called for a row that failed to parse, line is the 1-based line
+  // number in the input file. Exits if the row cannot be tolerated.
+  void report(long long line, const char *reason, const std::string &row){
+    ++num_errors_;
+    if (mode_ == ErrorMode::FAIL) {
+      std::cout<<"     Error in parsing line " << line << " ("<< reason
+               << ") "<< row << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+    if (mode_ == ErrorMode::REJECT) {
+      // Flushed right away, std::exit does not run the destructor of rfs_
+      rfs_<<line<<";"<<reason<<";"<<row<<std::endl;
+    }
+    if (max_errors_ >= 0 && num_errors_ > max_errors_) {
+      std::cout<<"     Error budget of " << max_errors_
+               << " bad rows exceeded at line " << line << " ("<< reason
+               << ") "<< row << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+  };
+  long long num_errors() const {
+    return num_errors_;
+  };
+  // Word describing what happened to the bad rows, for the summary
+  const char *action() const {
+    return mode_ == ErrorMode::REJECT ? "rejected" : "skipped";
+  };
+private:
+  ErrorMode mode_;
+  long long max_errors_;
+  long long num_errors_;
+  std::ofstream rfs_;
+};
+
+#endif // GPS2TRAJ_ROW_ERROR_HPP
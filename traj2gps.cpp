@@ -15,6 +15,9 @@
 #include <getopt.h>
 #include <chrono>
 #include <ctype.h>
+#include "async_io.hpp"
+#include "row_error.hpp"
+#include "projection.hpp"
 
 // Data types
 
@@ -37,6 +40,10 @@ struct InputConfig {
   bool header = true;
   std::string input_file;
   std::string output_file;
+  ErrorMode error_mode = ErrorMode::FAIL;
+  long long max_errors = 1000;
+  std::string reject_file;
+  Projection projection;
 };
 
 void read_header_config(InputConfig &config){
@@ -87,8 +94,8 @@ bool iequals(const std::string& a, const std::string& b)
   return true;
 };
 
-std::vector<Point> wkt2traj(const std::string &str){
-  std::vector<Point> pts;
+// Return NULL if the geometry is parsed, otherwise the reason of the error
+const char *wkt2traj(const std::string &str, std::vector<Point> &pts){
   std::stringstream stringStream(str);
   std::string line;
   std::vector<std::string> tokens;
@@ -113,26 +120,26 @@ std::vector<Point> wkt2traj(const std::string &str){
   }
   else
   {
-    std::cout<<"Error, geom field should start with LINESTRING "<<str<<"\n";
-    std::exit(EXIT_FAILURE);
+    return "geom field should start with LINESTRING";
   }
   while (iter!=tokens.end()) {
-    double x = std::stod(*iter);
+    double x, y;
+    if (!parse_double(*iter, x)) return "invalid coordinate";
     ++iter;
     if (iter!=tokens.end()) {
-      double y = std::stod(*iter);
+      if (!parse_double(*iter, y)) return "invalid coordinate";
       pts.push_back(Point{x,y});
       ++iter;
     } else {
-      std::cout<<"Error, uneven number of pts "<<str<<"\n";
-      std::exit(EXIT_FAILURE);
+      return "uneven number of coordinates";
     }
   }
-  return pts;
+  return NULL;
 };
 
-void read_row_to_trajectory(long long row_index, std::string &row,
-                            InputConfig &config, Trajectory &traj){
+// Return NULL if the row is parsed, otherwise the reason of the error
+const char *read_row_to_trajectory(std::string &row, InputConfig &config,
+                                   Trajectory &traj){
   // Parse fields from the input line
   std::stringstream ss(row);
   std::string intermediate;
@@ -146,19 +153,20 @@ void read_row_to_trajectory(long long row_index, std::string &row,
       id_parsed = true;
     }
     if (index == config.geom_idx) {
-      traj.points = wkt2traj(intermediate);
+      const char *error = wkt2traj(intermediate, traj.points);
+      if (error != NULL) return error;
       geom_parsed = true;
     }
     ++index;
     if (id_parsed && geom_parsed) break;
   }
   if (!(id_parsed && geom_parsed)) {
-    std::cout<<"     Error in parsing row " << row_index << " "<< row << "\n";
-    std::exit(EXIT_FAILURE);
+    return "missing fields";
   }
+  return NULL;
 };
 
-void write_trajectory(std::ofstream &ofs, Trajectory &traj){
+void write_trajectory(std::ostream &ofs, Trajectory &traj){
   for (int i = 0; i<traj.points.size(); ++i) {
     ofs<<traj.id<<";"<<i<<";"<<traj.points[i].x<<";"<<traj.points[i].y<<"\n";
   }
@@ -166,7 +174,8 @@ void write_trajectory(std::ofstream &ofs, Trajectory &traj){
 
 void traj2gps(InputConfig &config){
   std::cout<<"Read gps data\n";
-  std::ifstream ifs(config.input_file);
+  AsyncReadBuf ibuf(config.input_file);
+  std::istream ifs(&ibuf);
   long long num_traj;
   long long num_point;
   std::string row;
@@ -177,9 +186,16 @@ void traj2gps(InputConfig &config){
   } else {
     read_header_config(config);
   }
-  std::ofstream ofs(config.output_file);
+  AsyncWriteBuf obuf(config.output_file);
+  if (!obuf.is_open()) {
+    std::cout<<"Error: output file cannot be opened: "<<config.output_file<<"\n";
+    std::exit(EXIT_FAILURE);
+  }
+  std::ostream ofs(&obuf);
   ofs.precision(12);
   ofs << "id;point_idx;x;y\n";
+  RowErrorHandler error_handler(config.error_mode, config.max_errors,
+                                config.reject_file);
   long long progress = 0;
   // Ensure that the data is sorted in ascending order by time
   while (std::getline(ifs, row)) {
@@ -188,11 +204,28 @@ void traj2gps(InputConfig &config){
       std::cout<<"  Lines read " << progress << "\n";
     }
     Trajectory traj;
-    read_row_to_trajectory(progress, row, config, traj);
+    const char *error = read_row_to_trajectory(row, config, traj);
+    if (error != NULL) {
+      error_handler.report(progress + (config.header ? 1 : 0), error, row);
+      continue;
+    }
+    unproject_points(config.projection, traj.points);
     // std::cout << "Point timestamp "<< point.timestamp << "\n";
     write_trajectory(ofs,traj);
   }
+  if (ibuf.failed()) {
+    std::cout<<"Error: failed to read input file: "<<config.input_file<<"\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (!ofs.flush()) {
+    std::cout<<"Error: failed to write output file: "<<config.output_file<<"\n";
+    std::exit(EXIT_FAILURE);
+  }
   std::cout<<"Read gps data done with lines count "<<progress<<"\n";
+  if (error_handler.num_errors() > 0) {
+    std::cout<<"Bad rows "<<error_handler.action()<<" "
+             <<error_handler.num_errors()<<"\n";
+  }
 };
 
 bool check_file_exist(const std::string &filename){
@@ -212,6 +245,10 @@ void print_help(){
   std::cout<<"--id: id column name or index (id by default)\n";
   std::cout<<"-g/--geom: geom column name or index (geom by default)\n";
   std::cout<<"--no_header: if specified, traj file contains no header\n";
+  std::cout<<"--from_crs: project points from EPSG:3857 or UTM EPSG:326xx/327xx back to lon/lat, disabled by default\n";
+  std::cout<<"--on_error: action on a malformed row (fail, skip, reject), fail by default\n";
+  std::cout<<"--max_errors: maximum number of bad rows in skip/reject mode, negative for no limit (1000 by default)\n";
+  std::cout<<"--reject_file: file storing bad rows in reject mode (output file + .reject by default)\n";
   std::cout<<"-h/--help: print help information\n";
 };
 
@@ -228,6 +265,10 @@ void parse_arguments(int argc, char **argv, InputConfig &config){
     {"id", required_argument,0,  'a' },
     {"geom", required_argument,0,  'g' },
     {"no_header", no_argument,0,  'n' },
+    {"from_crs", required_argument,0,  'c' },
+    {"on_error", required_argument,0,  'e' },
+    {"max_errors", required_argument,0,  'm' },
+    {"reject_file", required_argument,0,  'r' },
     {"help",   no_argument,0,'h' },
     {0,         0,                 0,  0 }
   };
@@ -237,7 +278,7 @@ void parse_arguments(int argc, char **argv, InputConfig &config){
   // You should write your own code to enforce the existence of
   // options/arguments
   int long_index =0;
-  while ((opt = getopt_long(argc, argv,"i:o:d:a:g:nh",
+  while ((opt = getopt_long(argc, argv,"i:o:d:a:g:nc:e:m:r:h",
                             long_options, &long_index )) != -1)
   {
     switch (opt)
@@ -260,6 +301,24 @@ void parse_arguments(int argc, char **argv, InputConfig &config){
     case 'n':
       config.header = false;
       break;
+    case 'c':
+      if (!parse_crs(optarg, config.projection)) {
+        std::cout<<"Error: unsupported CRS: "<<optarg<<std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'e':
+      if (!parse_error_mode(optarg, config.error_mode)) {
+        std::cout<<"Error: unknown on_error mode: "<<optarg<<std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      config.max_errors = std::atoll(optarg);
+      break;
+    case 'r':
+      config.reject_file = std::string(optarg);
+      break;
     case 'h':
       std::cout<<"Help information:"<<std::endl;
       print_help();
@@ -284,6 +343,19 @@ void parse_arguments(int argc, char **argv, InputConfig &config){
   std::cout<<"Id name/index: "<< config.id_name <<std::endl;
   std::cout<<"Geom name/index: "<< config.geom_name <<std::endl;
   std::cout<<"Header: "<< (config.header ? "true" : "false") <<std::endl;
+  if (config.reject_file.empty()) {
+    config.reject_file = config.output_file + ".reject";
+  }
+  if (config.projection.type != Projection::NONE) {
+    std::cout<<"From CRS: EPSG:"<< config.projection.epsg <<std::endl;
+  }
+  std::cout<<"On error: "<< error_mode2string(config.error_mode) <<std::endl;
+  if (config.error_mode != ErrorMode::FAIL) {
+    std::cout<<"Max errors: "<< config.max_errors <<std::endl;
+  }
+  if (config.error_mode == ErrorMode::REJECT) {
+    std::cout<<"Reject file: "<< config.reject_file <<std::endl;
+  }
 };
 
 int main(int argc, char**argv){